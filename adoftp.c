@@ -6,6 +6,29 @@
 // compile on Linux:
 //   cc -lpthread -o adoftp adoftp.c
 //
+// graceful restart:
+//   kill -HUP <pid>
+//   the server re-executes its binary, hands over the listening socket to the
+//   new instance, stops accepting and exits once all running sessions finish
+//
+// directory retrieval:
+//   RETR dir or RETR dir.tar streams the whole tree as a tar archive over one
+//   data connection
+//
+// statistics:
+//   kill -USR1 <pid>
+//   prints out heap and resident memory used by client sessions and the latest
+//   TCP_INFO sample (rtt, congestion window, rate) of every running transfer
+//
+// limits:
+//   every session is a thread with its own stack, which takes a thread, a pid
+//   and two memory mappings (stack and guard page), so the number of sessions
+//   is bounded by ulimit -n and -u, kernel.threads-max, kernel.pid_max and
+//   vm.max_map_count (the default 65530 allows about 32k sessions), e.g. for
+//   100k idle sessions on Linux:
+//     ulimit -n 200000 -u 200000
+//     sysctl -w vm.max_map_count=262144 kernel.threads-max=200000 kernel.pid_max=4194304
+//
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,29 +39,101 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
 #define WRITE_BUFFER_SIZE 256
+#define INLINE_BUFFER_SIZE 128
 #define BUFFER_SIZE 4096
+#define REPLY_BUFFER_SIZE 1024
 #define FILE_READ_BUFFER_SIZE 4096
 
+#define TAR_BLOCK_SIZE 512
+#define TAR_PREFETCH_COUNT 32
+#define TAR_BUFFER_SIZE (64 * 1024)
+
+// limits of the adaptive data connection tuning
+#define DATA_CHUNK_MAX (256 * 1024)
+#define DATA_NOTSENT_LOWAT (128 * 1024)
+#define TCP_INFO_SAMPLE_INTERVAL 16
+
 #define CONN_MODE_ACTIVE 1
 #define CONN_MODE_PASSIVE 2
 
-// data for connected client, every thread has one instance of this struct
+// packs a command verb of up to four letters into an integer
+#define VERB(a, b, c, d) (((unsigned int)(a) << 24) | ((unsigned int)(b) << 16) | ((unsigned int)(c) << 8) | (unsigned int)(d))
+
+// environment variables used to hand over the listening socket on restart
+#define LISTEN_FD_ENV "ADOFTP_LISTEN_FD"
+#define READY_FD_ENV "ADOFTP_READY_FD"
+
+// seconds the old instance waits for running sessions after a restart
+#define DRAIN_TIMEOUT 600
+
+// stack size of client threads, handlers keep their large buffers on the heap,
+// the thread per session itself is what limits the number of sessions (see the limits above)
+#define SESSION_STACK_SIZE (64 * 1024)
+
+#define DIR_TABLE_SIZE 1024
+
+// interned current directory, shared by all clients in the same directory
+typedef struct dir_entry
+{
+	struct dir_entry * next;
+	int refcount;
+	char path[];
+} DIR_ENTRY;
+
+// file or directory opened ahead of the tar stream by the prefetch thread
+typedef struct tar_item
+{
+	struct tar_item * next;
+	char * name;
+	struct stat st;
+	int fd;
+} TAR_ITEM;
+
+// queue of prefetched tar items, filled by the prefetch thread and emptied by the client thread
 typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	TAR_ITEM * head;
+	TAR_ITEM * tail;
+	int count;
+	int done;
+	int cancelled;
+	char * path;
+	char * name;
+} TAR_QUEUE;
+
+// data for connected client, every thread has one instance of this struct
+typedef struct client_info
 {
 	int fd;
-	char buf[BUFFER_SIZE];
-	int buffer_pos;
+	char * buf;
+	int buffer_size;
+	int buffer_start;
+	int buffer_len;
+	int scan_pos;
+	char inline_buf[INLINE_BUFFER_SIZE];
+
+	char * reply_buf;
+	int reply_len;
 
 	int data_connection_mode;
 
@@ -48,13 +143,70 @@ typedef struct
 	int passive_fd;
 	int passive_client_fd;
 
-	char dir[PATH_MAX + 1];
+	DIR_ENTRY * dir;
 	int binary_flag;
+
+	int transferring;
+	int data_chunk;
+	int data_writes;
+	int data_sndbuf;
+	unsigned int tcp_rtt;
+	unsigned int tcp_cwnd;
+	unsigned int tcp_mss;
+	unsigned long long tcp_rate;
+
+	int busy;
+	int closing;
+	struct client_info * next;
 } CLIENT_INFO;
 
+// output buffer of the tar stream, small entries are sent together
+typedef struct
+{
+	CLIENT_INFO * client_info;
+	char * buf;
+	int used;
+	unsigned long long offset;
+} TAR_STREAM;
+
 // base directory
 char basedir[PATH_MAX + 1] = { 0 };
 
+// command line, used to re-execute the server on restart
+char ** server_argv = NULL;
+
+// environment, copied for the new instance on restart
+extern char ** environ;
+
+// send buffer size and congestion control algorithm for data connections, kernel defaults when unset
+int data_sndbuf = 0;
+char * data_congestion = NULL;
+
+// set from the signal handler, the main loop then performs a graceful restart
+volatile sig_atomic_t restart_requested = 0;
+
+// self-pipe written by the signal handlers, wakes up the main loop waiting in poll()
+int signal_pipe[2] = { -1, -1 };
+
+// list of running sessions, guarded by sessions_mutex
+pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessions_cond = PTHREAD_COND_INITIALIZER;
+CLIENT_INFO * sessions = NULL;
+int session_count = 0;
+int draining = 0;
+
+// set from the signal handler, the main loop then prints statistics
+volatile sig_atomic_t stats_requested = 0;
+
+// heap bytes held by client sessions, guarded by sessions_mutex
+long session_bytes = 0;
+
+// table of interned directories, guarded by dirs_mutex
+pthread_mutex_t dirs_mutex = PTHREAD_MUTEX_INITIALIZER;
+DIR_ENTRY * dirs[DIR_TABLE_SIZE] = { 0 };
+int dir_count = 0;
+long dir_bytes = 0;
+
 // prints out an error message and exits the program
 void epicfail(char * msg)
 {
@@ -63,7 +215,7 @@ void epicfail(char * msg)
 }
 
 // creates a TCP server socket, binds it to the specified address and port and starts listening
-int create_tcp_server_socket(char * addr, int port)
+int create_tcp_server_socket(char * addr, int port, int backlog)
 {
 	int sock;
 	if ((sock = socket(PF_INET, SOCK_STREAM, 6 /* TCP */)) == -1) epicfail("socket");
@@ -76,7 +228,7 @@ int create_tcp_server_socket(char * addr, int port)
 
 	if (bind(sock, (struct sockaddr *)&in, sizeof(in)) == -1) epicfail("bind");
 
-	if (listen(sock, 0) == -1) epicfail("listen");
+	if (listen(sock, backlog) == -1) epicfail("listen");
 	
 	return sock;
 }
@@ -87,21 +239,40 @@ int accept_connection(int fd)
 	struct sockaddr_in ca;
 	socklen_t sz = sizeof(ca);
 	int client;
-	if ((client = accept(fd, (struct sockaddr *)&ca, &sz)) == -1) epicfail("accept");
+	if ((client = accept(fd, (struct sockaddr *)&ca, &sz)) == -1)
+	{
+		if (errno == EINTR) return -1;
+		epicfail("accept");
+	}
 
 	return client;
 }
 
-// writes a null-terminated string into the file descriptor
-void write_string(int fd, char * s)
+// writes a null-terminated string into the file descriptor, returns -1 if that fails
+int write_string(int fd, char * s)
 {
 	int len = strlen(s);
 	int bytes_written = write(fd, s, len);
-	if (bytes_written != len) epicfail("write"); // TODO
+	if (bytes_written != len) return -1;
+
+	return 0;
+}
+
+// sends all queued replies to the client, the session is closed if that fails
+void flush_replies(CLIENT_INFO * client_info)
+{
+	if (client_info->reply_len == 0) return;
+
+	int bytes_written = write(client_info->fd, client_info->reply_buf, client_info->reply_len);
+	if (bytes_written != client_info->reply_len) client_info->closing = 1;
+
+	free(client_info->reply_buf);
+	client_info->reply_buf = NULL;
+	client_info->reply_len = 0;
 }
 
-// sends an FTP status code with a message
-void send_code_param(int fd, int code, char * p1)
+// queues an FTP status code with a message, replies to pipelined commands are sent together
+void send_code_param(CLIENT_INFO * client_info, int code, char * p1)
 {
 	char buf[WRITE_BUFFER_SIZE] = { 0 };
 
@@ -114,8 +285,10 @@ void send_code_param(int fd, int code, char * p1)
 	else if (code == 227) snprintf(buf, WRITE_BUFFER_SIZE - 1, "227 Entering Passive Mode (%s).", p1);
 	else if (code == 230) strncpy(buf, "230 User logged in", WRITE_BUFFER_SIZE - 1);
 	else if (code == 250) strncpy(buf, "250 Command successful", WRITE_BUFFER_SIZE - 1);
-	else if (code == 257) snprintf(buf, WRITE_BUFFER_SIZE - 1, "257 \"%s\"\r\n", p1);
+	else if (code == 257) snprintf(buf, WRITE_BUFFER_SIZE - 1, "257 \"%s\"", p1);
 	else if (code == 331) strncpy(buf, "331 User name ok, need password", WRITE_BUFFER_SIZE - 1);
+	else if (code == 421) strncpy(buf, "421 Service not available, closing control connection", WRITE_BUFFER_SIZE - 1);
+	else if (code == 451) strncpy(buf, "451 Requested action aborted: local error in processing", WRITE_BUFFER_SIZE - 1);
 	else if (code == 500) strncpy(buf, "500 Syntax error, command unrecognized", WRITE_BUFFER_SIZE - 1);
 	else if (code == 550) strncpy(buf, "550 Requested action not taken.", WRITE_BUFFER_SIZE - 1);
 	else epicfail("Invalid code.");
@@ -123,140 +296,232 @@ void send_code_param(int fd, int code, char * p1)
 	strncat(buf, "\r\n", WRITE_BUFFER_SIZE - 1);
 
 	int len = strlen(buf);
-	int bytes_written = write(fd, buf, len);
-	if (bytes_written != len) epicfail("write"); // TODO
+	if (client_info->reply_len + len > REPLY_BUFFER_SIZE) flush_replies(client_info);
+
+	if (! client_info->reply_buf)
+	{
+		client_info->reply_buf = malloc(REPLY_BUFFER_SIZE);
+		if (! client_info->reply_buf) epicfail("malloc");
+	}
+
+	memcpy(client_info->reply_buf + client_info->reply_len, buf, len);
+	client_info->reply_len += len;
+}
+
+// queues an FTP status code with a message
+void send_code(CLIENT_INFO * client_info, int code)
+{
+	send_code_param(client_info, code, NULL);
 }
 
-// sends an FTP status code with a message
-void send_code(int fd, int code)
+// adjusts the number of heap bytes held by client sessions
+void account_session_bytes(long delta)
 {
-	send_code_param(fd, code, NULL);
+	pthread_mutex_lock(&sessions_mutex);
+	session_bytes += delta;
+	pthread_mutex_unlock(&sessions_mutex);
 }
 
-// returns 1 if the buffer starts with the specified command
-int compare_command(char * buf, char * command)
+// returns the bucket of the directory table for the path
+unsigned int dir_hash(char * path)
 {
-	return memcmp(buf, command, strlen(command)) == 0;
+	unsigned int hash = 5381;
+	char * p;
+	for (p = path; *p; p++) hash = hash * 33 + (unsigned char)*p;
+
+	return hash % DIR_TABLE_SIZE;
 }
 
-// perform a read operation from the client
-int client_read(int fd, char * buf, int * buffer_pos)
+// returns the interned copy of the directory path, takes a reference
+DIR_ENTRY * intern_dir(char * path)
 {
-	if (BUFFER_SIZE - *buffer_pos - 1 == 0) epicfail("buffer full");
+	unsigned int hash = dir_hash(path);
+
+	pthread_mutex_lock(&dirs_mutex);
 
-	int bytes_read = read(fd, buf + *buffer_pos, BUFFER_SIZE - *buffer_pos - 1);
+	DIR_ENTRY * entry;
+	for (entry = dirs[hash]; entry; entry = entry->next)
+	{
+		if (strcmp(entry->path, path) == 0) break;
+	}
+
+	if (! entry)
+	{
+		int size = sizeof(DIR_ENTRY) + strlen(path) + 1;
+		entry = malloc(size);
+		if (! entry) epicfail("malloc");
+		strcpy(entry->path, path);
+		entry->refcount = 0;
+		entry->next = dirs[hash];
+		dirs[hash] = entry;
+		dir_count++;
+		dir_bytes += size;
+	}
+
+	entry->refcount++;
+	pthread_mutex_unlock(&dirs_mutex);
+
+	return entry;
+}
+
+// drops a reference to an interned directory, frees it when unused
+void release_dir(DIR_ENTRY * dir)
+{
+	pthread_mutex_lock(&dirs_mutex);
+
+	if (--dir->refcount == 0)
+	{
+		DIR_ENTRY ** e = &dirs[dir_hash(dir->path)];
+		while (*e != dir) e = &((*e)->next);
+		*e = dir->next;
+		dir_count--;
+		dir_bytes -= sizeof(DIR_ENTRY) + strlen(dir->path) + 1;
+		free(dir);
+	}
+
+	pthread_mutex_unlock(&dirs_mutex);
+}
+
+// perform a read operation from the client into the free part of the ring buffer,
+// the buffer grows from the inline storage when full, returns -1 if a line does not fit
+int client_read(CLIENT_INFO * client_info)
+{
+	if (client_info->buffer_len == client_info->buffer_size)
+	{
+		if (client_info->buffer_size == BUFFER_SIZE) return -1;
+
+		char * buf = malloc(BUFFER_SIZE);
+		if (! buf) epicfail("malloc");
+
+		// the inline storage is full, so it wraps at most once
+		int first = client_info->buffer_size - client_info->buffer_start;
+		memcpy(buf, client_info->buf + client_info->buffer_start, first);
+		memcpy(buf + first, client_info->buf, client_info->buffer_start);
+		client_info->buf = buf;
+		client_info->buffer_size = BUFFER_SIZE;
+		client_info->buffer_start = 0;
+		account_session_bytes(BUFFER_SIZE);
+	}
+
+	int end = (client_info->buffer_start + client_info->buffer_len) % client_info->buffer_size;
+	int space = (end >= client_info->buffer_start) ? client_info->buffer_size - end : client_info->buffer_start - end;
+
+	int bytes_read = read(client_info->fd, client_info->buf + end, space);
 	if (bytes_read == 0) return 0;
 	if (bytes_read == -1) return -1;
-	*buffer_pos += bytes_read;
+	client_info->buffer_len += bytes_read;
 
 	return bytes_read;
 }
 
-// read from the client until there is a whole line in the buffer
-int client_read_line(int fd, char * buf, int * buffer_pos)
+// returns the length of the first buffered line without its newline, or -1 if there is no whole line yet,
+// scanning resumes where the previous call stopped
+int find_line(CLIENT_INFO * client_info)
 {
-	while ((strstr(buf, "\r\n") == NULL) && (strstr(buf, "\n") == NULL))
+	while (client_info->scan_pos < client_info->buffer_len)
 	{
-		int res = client_read(fd, buf, buffer_pos);
-		if (res == -1) return -1;
+		int pos = (client_info->buffer_start + client_info->scan_pos) % client_info->buffer_size;
+		int count = client_info->buffer_size - pos;
+		if (count > client_info->buffer_len - client_info->scan_pos) count = client_info->buffer_len - client_info->scan_pos;
+
+		char * newline = memchr(client_info->buf + pos, '\n', count);
+		if (newline) return client_info->scan_pos + (newline - (client_info->buf + pos));
+
+		client_info->scan_pos += count;
 	}
 
-	return 0;
+	return -1;
 }
 
-// extract and remove a line from the buffer
-void extract_line(char * line, char * buf, int * buffer_pos)
+// extract and remove a line of the specified length from the buffer, returns the line allocated on the heap
+char * extract_line(CLIENT_INFO * client_info, int len)
 {
-	char * crlf_pos = strstr(buf, "\r\n");
-	int crlf_len = 2;
-	if (crlf_pos == NULL)
+	char * line = malloc(len + 1);
+	if (! line) epicfail("malloc");
+
+	int i;
+	for (i = 0; i < len; i++) line[i] = client_info->buf[(client_info->buffer_start + i) % client_info->buffer_size];
+	line[len] = 0;
+	if ((len > 0) && (line[len - 1] == '\r')) line[len - 1] = 0;
+
+	client_info->buffer_start = (client_info->buffer_start + len + 1) % client_info->buffer_size;
+	client_info->buffer_len -= len + 1;
+	client_info->scan_pos = 0;
+	if (client_info->buffer_len == 0) client_info->buffer_start = 0;
+
+	// return to the inline storage once the rest of the input fits again
+	if ((client_info->buf != client_info->inline_buf) && (client_info->buffer_len <= INLINE_BUFFER_SIZE))
 	{
-		crlf_pos = strstr(buf, "\n");
-		crlf_len = 1;
+		for (i = 0; i < client_info->buffer_len; i++) client_info->inline_buf[i] = client_info->buf[(client_info->buffer_start + i) % client_info->buffer_size];
+		free(client_info->buf);
+		client_info->buf = client_info->inline_buf;
+		client_info->buffer_size = INLINE_BUFFER_SIZE;
+		client_info->buffer_start = 0;
+		account_session_bytes(-BUFFER_SIZE);
 	}
 
-	if (crlf_pos == NULL) epicfail("No newline in buffer");
-
-	strncpy(line, buf, crlf_pos - buf);
-	int new_len = *buffer_pos - (crlf_pos - buf) - crlf_len;
-	memmove(buf, crlf_pos + crlf_len, new_len);
-	*buffer_pos = new_len;
+	return line;
 }
 
 // perform FTP USER command, take any username as valid
-void command_user(CLIENT_INFO * client_info)
+void command_user(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len < 6)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code(client_info->fd, 331);
+	send_code(client_info, 331);
 }
 
 // perform FTP PASS command, take any password as valid
-void command_pass(CLIENT_INFO * client_info)
+void command_pass(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len < 5)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code(client_info->fd, 230);
+	send_code(client_info, 230);
 }
 
 // perform FTP NOOP command
-void command_noop(CLIENT_INFO * client_info)
+void command_noop(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len != 4)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code(client_info->fd, 200);
+	send_code(client_info, 200);
 }
 
 // perform FTP SYST command, identify as a standard UNIX FTP server
-void command_syst(CLIENT_INFO * client_info)
+void command_syst(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len != 4)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code_param(client_info->fd, 215, "UNIX Type: L8");
+	send_code_param(client_info, 215, "UNIX Type: L8");
 }
 
 // perform FTP TYPE command, switch binary mode on and off
-void command_type(CLIENT_INFO * client_info)
+void command_type(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len < 6)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
@@ -267,40 +532,40 @@ void command_type(CLIENT_INFO * client_info)
 	else if (strcmp(param, "L 8") == 0) client_info->binary_flag = 1;
 	else
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code(client_info->fd, 200);
+	send_code(client_info, 200);
 }
 
 // perform FTP PWD command, prints current directory
-void command_pwd(CLIENT_INFO * client_info)
+void command_pwd(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len != 3)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	send_code_param(client_info->fd, 257, client_info->dir);
+	send_code_param(client_info, 257, client_info->dir->path);
 }
 
 // perform FTP PORT command, prepare for active data connection
-void command_port(CLIENT_INFO * client_info)
+void command_port(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
+	int len = strlen(line);
+	if (len < 6)
+	{
+		send_code(client_info, 500);
+		return;
+	}
 
 	int ip1, ip2, ip3, ip4, port1, port2;
 	if (sscanf(line + 5, "%d,%d,%d,%d,%d,%d", &ip1, &ip2, &ip3, &ip4, &port1, &port2) != 6)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
@@ -313,19 +578,16 @@ void command_port(CLIENT_INFO * client_info)
 	inet_pton(AF_INET, buf_addr, &(client_info->active_addr.sin_addr));
 	client_info->active_addr.sin_port = htons((port1 << 8) + port2);
 
-	send_code(client_info->fd, 200);
+	send_code(client_info, 200);
 }
 
 // perform FTP PASV command, prepare for passive data connection
-void command_pasv(CLIENT_INFO * client_info)
+void command_pasv(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len != 4)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
@@ -344,7 +606,7 @@ void command_pasv(CLIENT_INFO * client_info)
 	if (! ip) epicfail("inet_ntoa");
 
 	client_info->data_connection_mode = CONN_MODE_PASSIVE;
-	client_info->passive_fd = create_tcp_server_socket(ip, 0);
+	client_info->passive_fd = create_tcp_server_socket(ip, 0, 0);
 
 	l = sizeof(s);
 	getsockname(client_info->passive_fd, (struct sockaddr *)&s, &l);
@@ -358,7 +620,7 @@ void command_pasv(CLIENT_INFO * client_info)
 	char p[64];
 	sprintf(p, "%d,%d,%d,%d,%d,%d", ip1, ip2, ip3, ip4, port1, port2);
 
-	send_code_param(client_info->fd, 227, p);
+	send_code_param(client_info, 227, p);
 }
 
 // returns a letter representing the file type (specified by a mode_t)
@@ -375,9 +637,87 @@ static char ftypelet (mode_t bits)
   return '?';
 }
 
+// tunes the control connection, replies are coalesced already so Nagle only adds latency
+void tune_control_socket(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// tunes a data connection before the transfer starts
+void tune_data_socket(int fd)
+{
+	if (data_sndbuf > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &data_sndbuf, sizeof(data_sndbuf));
+
+#ifdef TCP_NOTSENT_LOWAT
+	// keep the unsent part of the socket buffer small, the rest of the data waits in the file
+	int lowat = DATA_NOTSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+
+#ifdef TCP_CONGESTION
+	if (data_congestion)
+	{
+		if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, data_congestion, strlen(data_congestion)) == -1) perror("TCP_CONGESTION");
+	}
+#endif
+}
+
+// returns the socket of the data connection
+int data_connection_fd(CLIENT_INFO * client_info)
+{
+	if (client_info->data_connection_mode == CONN_MODE_ACTIVE) return client_info->active_fd;
+
+	return client_info->passive_client_fd;
+}
+
+// holds back partial segments on the data connection while many small writes follow, or sends them when off
+void data_connection_cork(CLIENT_INFO * client_info, int on)
+{
+#ifdef TCP_CORK
+	setsockopt(data_connection_fd(client_info), IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+// samples TCP_INFO of the data connection and sizes the send chunks to the bandwidth-delay
+// product (congestion window times segment size), the send buffer is left to kernel autotuning
+void data_connection_sample(CLIENT_INFO * client_info)
+{
+#ifdef TCP_INFO
+	int fd = data_connection_fd(client_info);
+
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) return;
+
+	unsigned long long window = (unsigned long long)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+	unsigned long long rate = info.tcpi_rtt ? window * 1000000 / info.tcpi_rtt : 0;
+
+	unsigned long long chunk = FILE_READ_BUFFER_SIZE;
+	while ((chunk < window) && (chunk < DATA_CHUNK_MAX)) chunk *= 2;
+
+	// setting SO_SNDBUF would turn off autotuning, so the size is only reported
+	int sndbuf = 0;
+	len = sizeof(sndbuf);
+	getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->data_chunk = (int)chunk;
+	client_info->data_sndbuf = sndbuf;
+	client_info->tcp_rtt = info.tcpi_rtt;
+	client_info->tcp_cwnd = info.tcpi_snd_cwnd;
+	client_info->tcp_mss = info.tcpi_snd_mss;
+	client_info->tcp_rate = rate;
+	pthread_mutex_unlock(&sessions_mutex);
+#endif
+}
+
 // opens a data connection with the client (either passive or active)
 void open_data_connection(CLIENT_INFO * client_info)
 {
+	// the preliminary reply has to reach the client before the transfer starts
+	flush_replies(client_info);
+
 	if (client_info->data_connection_mode == CONN_MODE_ACTIVE)
 	{
 		client_info->active_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -395,11 +735,24 @@ void open_data_connection(CLIENT_INFO * client_info)
 	{
 		epicfail("open_data_connection");
 	}
+
+	tune_data_socket(data_connection_fd(client_info));
+
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->transferring = 1;
+	client_info->data_chunk = FILE_READ_BUFFER_SIZE;
+	client_info->data_writes = 0;
+	client_info->tcp_rtt = 0;
+	pthread_mutex_unlock(&sessions_mutex);
 }
 
 // closes the data connection to the client
 void close_data_connection(CLIENT_INFO * client_info)
 {
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->transferring = 0;
+	pthread_mutex_unlock(&sessions_mutex);
+
 	if (client_info->data_connection_mode == CONN_MODE_ACTIVE)
 	{
 		close(client_info->active_fd);
@@ -412,12 +765,14 @@ void close_data_connection(CLIENT_INFO * client_info)
 	}
 }
 
-// sends a string over the data connection
-void data_connection_write_string(CLIENT_INFO * client_info, char * str)
+// sends a string over the data connection, returns -1 if the client went away
+int data_connection_write_string(CLIENT_INFO * client_info, char * str)
 {
-	if (client_info->data_connection_mode == CONN_MODE_ACTIVE) write_string(client_info->active_fd, str);
-	else if (client_info->data_connection_mode == CONN_MODE_PASSIVE) write_string(client_info->passive_client_fd, str);
+	if (client_info->data_connection_mode == CONN_MODE_ACTIVE) return write_string(client_info->active_fd, str);
+	else if (client_info->data_connection_mode == CONN_MODE_PASSIVE) return write_string(client_info->passive_client_fd, str);
 	else epicfail("data_connection_write_string");
+
+	return -1;
 }
 
 // sends a buffer over the data connection
@@ -431,15 +786,34 @@ int data_connection_write_buffer(CLIENT_INFO * client_info, char * buf, int len)
 
 	if (len != bytes_written) return -1;
 
+	if (++client_info->data_writes % TCP_INFO_SAMPLE_INTERVAL == 0) data_connection_sample(client_info);
+
 	return 0;
 }
 
+// allocates a transient path buffer, handlers keep these off the thread stack
+char * alloc_path()
+{
+	char * path = calloc(1, PATH_MAX + 1);
+	if (! path) epicfail("calloc");
+
+	return path;
+}
+
+// joins the directory and the entry name into pathbuf and stats the entry,
+// symbolic links are followed only when follow_links is set, returns -1 if the entry cannot be stat'ed
+int stat_dir_entry(char * pathbuf, char * dir, char * name, struct stat * s, int follow_links)
+{
+	int len = strlen(dir);
+	if ((len > 0) && (dir[len - 1] == '/')) snprintf(pathbuf, PATH_MAX, "%s%s", dir, name);
+	else snprintf(pathbuf, PATH_MAX, "%s/%s", dir, name);
+
+	return follow_links ? stat(pathbuf, s) : lstat(pathbuf, s);
+}
+
 // perform FTP LIST command, sends a directory listing to the client
-void command_list(CLIENT_INFO * client_info)
+void command_list(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 
 	char * path = NULL;
@@ -455,8 +829,8 @@ void command_list(CLIENT_INFO * client_info)
 		path = p;
 	}
 
-	char dirbuf[PATH_MAX + 1] = { 0 };
-	snprintf(dirbuf, PATH_MAX, "%s%s", basedir, client_info->dir);
+	char * dirbuf = alloc_path();
+	snprintf(dirbuf, PATH_MAX, "%s%s", basedir, client_info->dir->path);
 
 	if (path)
 	{
@@ -466,19 +840,22 @@ void command_list(CLIENT_INFO * client_info)
 		}
 		else
 		{
-			strcat(dirbuf, "/");
-			strcat(dirbuf, path);
+			strncat(dirbuf, "/", PATH_MAX - strlen(dirbuf));
+			strncat(dirbuf, path, PATH_MAX - strlen(dirbuf));
 		}
 	}
 
-	char realpathbuf[PATH_MAX + 1] = { 0 };
+	char * realpathbuf = alloc_path();
 	if (! realpath(dirbuf, realpathbuf))
 	{
-		send_code(client_info->fd, 550);
+		send_code(client_info, 550);
+		free(realpathbuf);
+		free(dirbuf);
 		return;
 	}
 
 	strcpy(dirbuf, realpathbuf);
+	free(realpathbuf);
 
 	if (dirbuf[strlen(dirbuf) - 1] != '/')
 		strncat(dirbuf, "/", PATH_MAX);
@@ -486,113 +863,529 @@ void command_list(CLIENT_INFO * client_info)
 	DIR * dirp = opendir(dirbuf);
 	if (! dirp)
 	{
-		send_code(client_info->fd, 550);
+		send_code(client_info, 550);
+		free(dirbuf);
 		return;
 	}
 
-	send_code(client_info->fd, 150);
+	send_code(client_info, 150);
 	open_data_connection(client_info);
+	data_connection_cork(client_info, 1);
+
+	char * filenamebuf = alloc_path();
+	char * buf = malloc(PATH_MAX + 128 + 1);
+	if (! buf) epicfail("malloc");
 
 	while (1)
 	{
 		struct dirent * entry = readdir(dirp);
 		if (! entry) break;
 
-		char filenamebuf[PATH_MAX + 1] = { 0 };
-		snprintf(filenamebuf, PATH_MAX, "%s%s", dirbuf, entry->d_name);
-
 		struct stat s;
-		if (stat(filenamebuf, &s) == -1)
+		if (stat_dir_entry(filenamebuf, dirbuf, entry->d_name, &s, 1) == -1)
 		{
 			// cannot stat
 			continue;
 		}
 
-		char buf[PATH_MAX + 128 + 1] = { 0 };
+		memset(buf, 0, PATH_MAX + 128 + 1);
 		strmode(s.st_mode, buf);
 		unsigned int size = (unsigned int)s.st_size;
 		char date[64];
 		struct tm * ts = localtime(&s.st_mtime);
 		strftime(date, 64, "%b %e  %Y", ts);
 		sprintf(buf + 11, "%3d %-8d %-8d %8u %s %s\r\n", s.st_nlink, (int)s.st_uid, (int)s.st_gid, size, date, entry->d_name);
-		data_connection_write_string(client_info, buf);
+		if (data_connection_write_string(client_info, buf) == -1) break;
 	}
 
+	free(buf);
+	free(filenamebuf);
+	free(dirbuf);
+	closedir(dirp);
+
+	data_connection_cork(client_info, 0);
 	close_data_connection(client_info);
 
-	send_code(client_info->fd, 226);
+	send_code(client_info, 226);
 }
 
 // perform FTP CWD command, changes directory
-void command_cwd(CLIENT_INFO * client_info)
+void command_cwd(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len < 5)
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
-	char dirbackup[PATH_MAX + 1] = { 0 };
-	strncpy(dirbackup, client_info->dir, PATH_MAX);
+	char * newdir = alloc_path();
 
 	char * dir = line + 4;
 	if (dir[0] == '/')
 	{
-		strncpy(client_info->dir, dir, PATH_MAX);
+		strncpy(newdir, dir, PATH_MAX);
 	}
 	else
 	{
-		strncat(client_info->dir, dir, PATH_MAX);
-		strncat(client_info->dir, "/", PATH_MAX);
+		snprintf(newdir, PATH_MAX, "%s%s/", client_info->dir->path, dir);
 	}
 
-	char dirbuf[PATH_MAX + 1] = { 0 };
-	snprintf(dirbuf, PATH_MAX, "%s%s", basedir, client_info->dir);
+	char * dirbuf = alloc_path();
+	snprintf(dirbuf, PATH_MAX, "%s%s", basedir, newdir);
+
+	// the resolved directory must be basedir itself or lie below it, not merely share its prefix
+	char * pathbuf = alloc_path();
+	int baselen = strlen(basedir);
+	int ok = realpath(dirbuf, pathbuf) && (strncmp(pathbuf, basedir, baselen) == 0) &&
+		((pathbuf[baselen] == '/') || (pathbuf[baselen] == 0));
+	free(dirbuf);
 
-	char pathbuf[PATH_MAX + 1] = { 0 };
-	if (! realpath(dirbuf, pathbuf))
+	if (! ok)
 	{
-		strncpy(client_info->dir, dirbackup, PATH_MAX);
-		send_code(client_info->fd, 550);
+		free(pathbuf);
+		free(newdir);
+		send_code(client_info, 550);
 		return;
 	}
 
-	strncpy(client_info->dir, pathbuf, PATH_MAX);
+	strncpy(newdir, pathbuf + baselen, PATH_MAX);
+	free(pathbuf);
+
+	if ((newdir[0] == 0) || (newdir[strlen(newdir) - 1] != '/'))
+		strncat(newdir, "/", PATH_MAX);
+
+	DIR_ENTRY * olddir = client_info->dir;
+	client_info->dir = intern_dir(newdir);
+	release_dir(olddir);
+	free(newdir);
+
+	send_code(client_info, 250);
+}
+
+// sends up to limit bytes of the file over the data connection in chunks sized by the TCP_INFO samples,
+// counts the bytes sent in sent, returns -1 if the client went away and -2 if the file cannot be read
+int send_file_data(CLIENT_INFO * client_info, int fd, unsigned long long limit, unsigned long long * sent)
+{
+	int buffer_size = client_info->data_chunk;
+	char * buf = malloc(buffer_size);
+	if (! buf) epicfail("malloc");
+
+	int res = 0;
+	*sent = 0;
+	while (*sent < limit)
+	{
+		if (client_info->data_chunk > buffer_size)
+		{
+			buffer_size = client_info->data_chunk;
+			buf = realloc(buf, buffer_size);
+			if (! buf) epicfail("realloc");
+		}
+
+		int len = buffer_size;
+		if ((unsigned long long)len > limit - *sent) len = (int)(limit - *sent);
+
+		int bytes_read = read(fd, buf, len);
+		if (bytes_read == 0) break;
+		if (bytes_read == -1)
+		{
+			res = -2;
+			break;
+		}
 
-	if (strlen(client_info->dir) < strlen(basedir))
+		if (data_connection_write_buffer(client_info, buf, bytes_read) == -1)
+		{
+			res = -1;
+			break;
+		}
+
+		*sent += bytes_read;
+	}
+
+	free(buf);
+
+	return res;
+}
+
+// adds an item to the tar queue, waits while the queue is full, returns -1 if the transfer was cancelled
+int tar_queue_push(TAR_QUEUE * queue, TAR_ITEM * item)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while ((queue->count >= TAR_PREFETCH_COUNT) && (! queue->cancelled)) pthread_cond_wait(&queue->cond, &queue->mutex);
+
+	int cancelled = queue->cancelled;
+	if (! cancelled)
+	{
+		item->next = NULL;
+		if (queue->tail) queue->tail->next = item;
+		else queue->head = item;
+		queue->tail = item;
+		queue->count++;
+		pthread_cond_broadcast(&queue->cond);
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+
+	return cancelled ? -1 : 0;
+}
+
+// removes the next item from the tar queue, returns NULL when the walk is finished
+TAR_ITEM * tar_queue_pop(TAR_QUEUE * queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while ((! queue->head) && (! queue->done)) pthread_cond_wait(&queue->cond, &queue->mutex);
+
+	TAR_ITEM * item = queue->head;
+	if (item)
+	{
+		queue->head = item->next;
+		if (! queue->head) queue->tail = NULL;
+		queue->count--;
+		pthread_cond_broadcast(&queue->cond);
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+
+	return item;
+}
+
+// frees a tar item and closes its file
+void tar_item_free(TAR_ITEM * item)
+{
+	if (item->fd != -1) close(item->fd);
+	free(item->name);
+	free(item);
+}
+
+// queues an archive entry, regular files are opened so the stream never waits for open()
+int tar_prefetch(TAR_QUEUE * queue, char * path, char * name, struct stat * s)
+{
+	TAR_ITEM * item = calloc(1, sizeof(TAR_ITEM));
+	if (! item) epicfail("calloc");
+	item->name = strdup(name);
+	if (! item->name) epicfail("strdup");
+	item->st = *s;
+	item->fd = -1;
+
+	if (S_ISREG(s->st_mode))
 	{
-		strncpy(client_info->dir, dirbackup, PATH_MAX);
-		send_code(client_info->fd, 550);
+		item->fd = open(path, O_RDONLY);
+		if (item->fd == -1)
+		{
+			// cannot open file
+			tar_item_free(item);
+			return 0;
+		}
+
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(item->fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+	}
+
+	if (tar_queue_push(queue, item) == -1)
+	{
+		tar_item_free(item);
+		return -1;
+	}
+
+	return 0;
+}
+
+// walks the directory tree and queues its entries, symbolic links and special files are skipped
+int tar_walk(TAR_QUEUE * queue, char * path, char * name)
+{
+	DIR * dirp = opendir(path);
+	if (! dirp) return 0;
+
+	char * childpath = alloc_path();
+	char * childname = alloc_path();
+	int result = 0;
+
+	while (result == 0)
+	{
+		struct dirent * entry = readdir(dirp);
+		if (! entry) break;
+		if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+
+		struct stat s;
+		if (stat_dir_entry(childpath, path, entry->d_name, &s, 0) == -1)
+		{
+			// cannot stat
+			continue;
+		}
+
+		snprintf(childname, PATH_MAX, "%s%s", name, entry->d_name);
+
+		if (S_ISDIR(s.st_mode))
+		{
+			strncat(childname, "/", PATH_MAX - strlen(childname));
+			result = tar_prefetch(queue, childpath, childname, &s);
+			if (result == 0) result = tar_walk(queue, childpath, childname);
+		}
+		else if (S_ISREG(s.st_mode))
+		{
+			result = tar_prefetch(queue, childpath, childname, &s);
+		}
+	}
+
+	free(childname);
+	free(childpath);
+	closedir(dirp);
+
+	return result;
+}
+
+// prefetch thread of the tar stream, walks the directory ahead of the client thread
+void * tar_prefetch_proc(void * param)
+{
+	TAR_QUEUE * queue = param;
+
+	struct stat s;
+	if ((queue->name[0] == 0) || (stat(queue->path, &s) == -1) || (tar_prefetch(queue, queue->path, queue->name, &s) == 0))
+		tar_walk(queue, queue->path, queue->name);
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->done = 1;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return NULL;
+}
+
+// writes an octal number into a tar header field, numbers too large for the field use the base-256 extension
+void tar_number(char * field, int size, unsigned long long value)
+{
+	if (value < (1ULL << (3 * (size - 1))))
+	{
+		snprintf(field, size, "%0*llo", size - 1, value);
 		return;
 	}
 
-	memmove(client_info->dir, client_info->dir + strlen(basedir), strlen(client_info->dir) - strlen(basedir) + 1);
+	int i;
+	for (i = size - 1; i > 0; i--)
+	{
+		field[i] = value & 0xff;
+		value >>= 8;
+	}
+
+	field[0] = (char)0x80;
+}
+
+// fills a ustar header block
+void tar_header(char * block, char * name, char type, mode_t mode, uid_t uid, gid_t gid, unsigned long long size, time_t mtime)
+{
+	memset(block, 0, TAR_BLOCK_SIZE);
+	strncpy(block, name, 100);
+	tar_number(block + 100, 8, mode & 07777);
+	tar_number(block + 108, 8, uid);
+	tar_number(block + 116, 8, gid);
+	tar_number(block + 124, 12, size);
+	tar_number(block + 136, 12, mtime);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+
+	memset(block + 148, ' ', 8);
+	unsigned int checksum = 0;
+	int i;
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) checksum += (unsigned char)block[i];
+	snprintf(block + 148, 7, "%06o", checksum);
+}
 
-	if (client_info->dir[strlen(client_info->dir) - 1] != '/')
-		strncat(client_info->dir, "/", PATH_MAX);
+// sends the buffered part of the tar stream, returns -1 if the client went away
+int tar_flush(TAR_STREAM * stream)
+{
+	int res = 0;
+	if (stream->used > 0) res = data_connection_write_buffer(stream->client_info, stream->buf, stream->used);
+	stream->used = 0;
 
-	send_code(client_info->fd, 250);
+	return res;
+}
+
+// returns the free part of the tar stream buffer, at least one block is free
+char * tar_reserve(TAR_STREAM * stream, int * available)
+{
+	if ((TAR_BUFFER_SIZE - stream->used < TAR_BLOCK_SIZE) && (tar_flush(stream) == -1)) return NULL;
+
+	*available = TAR_BUFFER_SIZE - stream->used;
+	return stream->buf + stream->used;
+}
+
+// adds one header block to the tar stream
+int tar_stream_header(TAR_STREAM * stream, char * name, char type, struct stat * s, unsigned long long size)
+{
+	int available;
+	char * block = tar_reserve(stream, &available);
+	if (! block) return -1;
+
+	if (s) tar_header(block, name, type, s->st_mode, s->st_uid, s->st_gid, size, s->st_mtime);
+	else tar_header(block, name, type, 0, 0, 0, size, 0);
+	stream->used += TAR_BLOCK_SIZE;
+	stream->offset += TAR_BLOCK_SIZE;
+
+	return 0;
+}
+
+// adds data to the tar stream, read from the file descriptor, copied from the buffer,
+// or zeros when both are unset, a file that shrank meanwhile is continued with zeros
+int tar_stream_data(TAR_STREAM * stream, int fd, char * data, unsigned long long size)
+{
+	while (size > 0)
+	{
+		int available;
+		char * p = tar_reserve(stream, &available);
+		if (! p) return -1;
+
+		int chunk = ((unsigned long long)available < size) ? available : (int)size;
+		if (fd != -1)
+		{
+			int bytes_read = read(fd, p, chunk);
+			if (bytes_read > 0) chunk = bytes_read;
+			else fd = -1;
+		}
+
+		if (fd == -1)
+		{
+			if (data) memcpy(p, data, chunk);
+			else memset(p, 0, chunk);
+		}
+
+		if (data) data += chunk;
+		stream->used += chunk;
+		stream->offset += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+// pads the tar stream with zeros to the next block boundary
+int tar_stream_pad(TAR_STREAM * stream)
+{
+	return tar_stream_data(stream, -1, NULL, (TAR_BLOCK_SIZE - stream->offset % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+// adds one archive entry to the tar stream, returns -1 if the client went away
+int tar_send_item(TAR_STREAM * stream, TAR_ITEM * item)
+{
+	int len = strlen(item->name);
+
+	// names longer than the header field are sent as a GNU long name entry first
+	if (len > 100)
+	{
+		if (tar_stream_header(stream, "././@LongLink", 'L', NULL, len + 1) == -1) return -1;
+		if (tar_stream_data(stream, -1, item->name, len + 1) == -1) return -1;
+		if (tar_stream_pad(stream) == -1) return -1;
+	}
+
+	if (item->fd == -1) return tar_stream_header(stream, item->name, '5', &item->st, 0);
+
+	unsigned long long size = item->st.st_size;
+	if (tar_stream_header(stream, item->name, '0', &item->st, size) == -1) return -1;
+
+	if (size < TAR_BUFFER_SIZE)
+	{
+		// small files are gathered in the stream buffer and sent together
+		if (tar_stream_data(stream, item->fd, NULL, size) == -1) return -1;
+	}
+	else
+	{
+		// large files go out through the RETR send path, the header has promised the size
+		// so zeros stand in for data missing if the file shrank or cannot be read
+		if (tar_flush(stream) == -1) return -1;
+		unsigned long long sent;
+		if (send_file_data(stream->client_info, item->fd, size, &sent) == -1) return -1;
+		stream->offset += sent;
+		if (tar_stream_data(stream, -1, NULL, size - sent) == -1) return -1;
+	}
+
+	return tar_stream_pad(stream);
+}
+
+// sends a directory tree as a tar archive over a single data connection
+void send_tar(CLIENT_INFO * client_info, char * path)
+{
+	char * realpathbuf = alloc_path();
+	int baselen = strlen(basedir);
+	if ((! realpath(path, realpathbuf)) || (strncmp(realpathbuf, basedir, baselen) != 0) ||
+		((realpathbuf[baselen] != '/') && (realpathbuf[baselen] != 0)))
+	{
+		send_code(client_info, 550);
+		free(realpathbuf);
+		return;
+	}
+
+	// entries are named relative to the parent of the directory, the base directory itself has no prefix
+	char * name = alloc_path();
+	char * visible = realpathbuf + strlen(basedir);
+	char * last = strrchr(visible, '/');
+	if (last && last[1]) snprintf(name, PATH_MAX, "%s/", last + 1);
+
+	TAR_QUEUE queue;
+	memset(&queue, 0, sizeof(queue));
+	pthread_mutex_init(&queue.mutex, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	queue.path = realpathbuf;
+	queue.name = name;
+
+	send_code(client_info, 150);
+	open_data_connection(client_info);
+
+	pthread_t thread_id;
+	if (pthread_create(&thread_id, NULL, tar_prefetch_proc, &queue)) epicfail("pthread_create");
+
+	TAR_STREAM stream;
+	stream.client_info = client_info;
+	stream.buf = malloc(TAR_BUFFER_SIZE);
+	if (! stream.buf) epicfail("malloc");
+	stream.used = 0;
+	stream.offset = 0;
+
+	int failed = 0;
+	TAR_ITEM * item;
+	while ((item = tar_queue_pop(&queue)))
+	{
+		if ((! failed) && (tar_send_item(&stream, item) == -1))
+		{
+			failed = 1;
+			pthread_mutex_lock(&queue.mutex);
+			queue.cancelled = 1;
+			pthread_cond_broadcast(&queue.cond);
+			pthread_mutex_unlock(&queue.mutex);
+		}
+
+		tar_item_free(item);
+	}
+
+	pthread_join(thread_id, NULL);
+
+	// end of archive
+	if (! failed) tar_stream_data(&stream, -1, NULL, TAR_BLOCK_SIZE * 2);
+	if (! failed) tar_flush(&stream);
+	free(stream.buf);
+
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.mutex);
+	free(name);
+	free(realpathbuf);
+
+	close_data_connection(client_info);
+
+	send_code(client_info, 226);
 }
 
 // perform FTP RETR command, sends a file to the client
-void command_retr(CLIENT_INFO * client_info)
+void command_retr(CLIENT_INFO * client_info, char * line)
 {
-	char line[BUFFER_SIZE] = { 0 };
-	client_read_line(client_info->fd, client_info->buf, &client_info->buffer_pos);
-	extract_line(line, client_info->buf, &client_info->buffer_pos);
 	int len = strlen(line);
 	if (len < 6) 
 	{
-		send_code(client_info->fd, 500);
+		send_code(client_info, 500);
 		return;
 	}
 
 	char * filename = line + 5;
-	char filenamebuf[PATH_MAX + 1] = { 0 };
+	char * filenamebuf = alloc_path();
 
 	if (filename[0] == '/')
 	{
@@ -600,100 +1393,428 @@ void command_retr(CLIENT_INFO * client_info)
 	}
 	else
 	{
-		snprintf(filenamebuf, PATH_MAX, "%s%s%s", basedir, client_info->dir, filename);
+		snprintf(filenamebuf, PATH_MAX, "%s%s%s", basedir, client_info->dir->path, filename);
+	}
+
+	// a directory, or name.tar naming a directory, is sent as a tar archive of the whole tree
+	struct stat s;
+	int namelen = strlen(filenamebuf);
+	if ((stat(filenamebuf, &s) == -1) && (namelen > 4) && (strcmp(filenamebuf + namelen - 4, ".tar") == 0))
+	{
+		filenamebuf[namelen - 4] = 0;
+		if ((stat(filenamebuf, &s) == -1) || (! S_ISDIR(s.st_mode))) filenamebuf[namelen - 4] = '.';
+	}
+
+	if ((stat(filenamebuf, &s) == 0) && S_ISDIR(s.st_mode))
+	{
+		send_tar(client_info, filenamebuf);
+		free(filenamebuf);
+		return;
 	}
 
 	int fd = open(filenamebuf, O_RDONLY);
+	free(filenamebuf);
 	if (fd == -1)
 	{
 		// cannot open file
-		send_code(client_info->fd, 550);
+		send_code(client_info, 550);
 		return;
 	}
 
-	send_code(client_info->fd, 150);
+	send_code(client_info, 150);
 	open_data_connection(client_info);
 
-	while (1)
+	unsigned long long sent;
+	int res = send_file_data(client_info, fd, (unsigned long long)-1, &sent);
+
+	close(fd);
+
+	close_data_connection(client_info);
+
+	// a read error must not be reported as a complete transfer
+	if (res == -2) send_code(client_info, 451);
+	else send_code(client_info, 226);
+}
+
+// perform FTP QUIT command
+void command_quit(CLIENT_INFO * client_info)
+{
+	send_code(client_info, 221);
+	client_info->closing = 1;
+}
+
+// returns the command verb of the line packed by VERB, or 0 if it is not a word of up to four letters
+unsigned int command_verb(char * line)
+{
+	unsigned int verb = 0;
+	int i;
+	for (i = 0; i < 4; i++)
 	{
-		char buf[FILE_READ_BUFFER_SIZE];
-		int bytes_read = read(fd, buf, FILE_READ_BUFFER_SIZE);
-		if (bytes_read == 0) break;
-		if (bytes_read == -1) epicfail("read");
+		if ((line[i] == 0) || (line[i] == ' ')) break;
+		verb |= (unsigned int)toupper((unsigned char)line[i]) << (24 - 8 * i);
+	}
 
-		int res = data_connection_write_buffer(client_info, buf, bytes_read);
-		if (res == -1) break;
+	if ((line[i] != 0) && (line[i] != ' ')) return 0;
+
+	return verb;
+}
+
+// calls the handler for the command on the line
+void dispatch_command(CLIENT_INFO * client_info, char * line)
+{
+	switch (command_verb(line))
+	{
+		case VERB('U', 'S', 'E', 'R'): command_user(client_info, line); break;
+		case VERB('P', 'A', 'S', 'S'): command_pass(client_info, line); break;
+		case VERB('P', 'W', 'D', 0): command_pwd(client_info, line); break;
+		case VERB('P', 'O', 'R', 'T'): command_port(client_info, line); break;
+		case VERB('P', 'A', 'S', 'V'): command_pasv(client_info, line); break;
+		case VERB('L', 'I', 'S', 'T'): command_list(client_info, line); break;
+		case VERB('C', 'W', 'D', 0): command_cwd(client_info, line); break;
+		case VERB('R', 'E', 'T', 'R'): command_retr(client_info, line); break;
+		case VERB('N', 'O', 'O', 'P'): command_noop(client_info, line); break;
+		case VERB('S', 'Y', 'S', 'T'): command_syst(client_info, line); break;
+		case VERB('T', 'Y', 'P', 'E'): command_type(client_info, line); break;
+		case VERB('Q', 'U', 'I', 'T'): command_quit(client_info); break;
+		default: send_code(client_info, 500); break;
 	}
+}
 
-	close(fd);
+// adds the session to the list of running sessions
+void register_session(CLIENT_INFO * client_info)
+{
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->next = sessions;
+	sessions = client_info;
+	session_count++;
+	pthread_mutex_unlock(&sessions_mutex);
+}
 
-	close_data_connection(client_info);
+// removes the session from the list of running sessions
+void unregister_session(CLIENT_INFO * client_info)
+{
+	pthread_mutex_lock(&sessions_mutex);
+	CLIENT_INFO ** p = &sessions;
+	while (*p != client_info) p = &((*p)->next);
+	*p = client_info->next;
+	session_count--;
+	pthread_cond_broadcast(&sessions_cond);
+	pthread_mutex_unlock(&sessions_mutex);
+}
+
+// marks the session as waiting for a command, returns 0 if the server is draining and the session should end
+int session_set_idle(CLIENT_INFO * client_info)
+{
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->busy = 0;
+	int result = ! draining;
+	pthread_mutex_unlock(&sessions_mutex);
 
-	send_code(client_info->fd, 226);
+	return result;
 }
 
-// reads a line from the client buffer
-void get_line(int fd, char * line, char * buf, int * buffer_pos)
+// returns 1 if the server hands over to a new instance and sessions should end
+int server_draining()
 {
-	client_read_line(fd, buf, buffer_pos);
-	extract_line(line, buf, buffer_pos);
+	pthread_mutex_lock(&sessions_mutex);
+	int result = draining;
+	pthread_mutex_unlock(&sessions_mutex);
+
+	return result;
+}
+
+// marks the session as processing a command, draining will not interrupt it
+void session_set_busy(CLIENT_INFO * client_info)
+{
+	pthread_mutex_lock(&sessions_mutex);
+	client_info->busy = 1;
+	pthread_mutex_unlock(&sessions_mutex);
+}
+
+// allocates the state of an accepted client and registers it,
+// runs in the main thread so a restart right after accept() already waits for the session
+CLIENT_INFO * create_session(int fd)
+{
+	CLIENT_INFO * client_info = calloc(1, sizeof(CLIENT_INFO));
+	if (! client_info) epicfail("calloc");
+	account_session_bytes(sizeof(CLIENT_INFO));
+
+	client_info->fd = fd;
+	client_info->buf = client_info->inline_buf;
+	client_info->buffer_size = INLINE_BUFFER_SIZE;
+	client_info->dir = intern_dir("/");
+
+	register_session(client_info);
+
+	return client_info;
 }
 
 // main client handler procedure, runs in its own thread
 void * thread_proc(void * param)
 {
-	CLIENT_INFO client_info;
-	memset(&client_info, 0, sizeof(client_info));
-	client_info.fd = (int)param;
-	strcpy(client_info.dir, "/");
+	CLIENT_INFO * client_info = (CLIENT_INFO *)param;
 
-	send_code(client_info.fd, 220);
+	tune_control_socket(client_info->fd);
 
-	while (1)
-	{
-		int result = client_read(client_info.fd, client_info.buf, &client_info.buffer_pos);
-		if (result == -1) break;
+	send_code(client_info, 220);
 
-		while (client_info.buffer_pos >= 4)
+	while (! client_info->closing)
+	{
+		int len = find_line(client_info);
+		if (len == -1)
 		{
-			char line[BUFFER_SIZE] = { 0 };
-
-			if (compare_command(client_info.buf, "USER")) command_user(&client_info);
-			else if (compare_command(client_info.buf, "PASS")) command_pass(&client_info);
-			else if (compare_command(client_info.buf, "PWD")) command_pwd(&client_info);
-			else if (compare_command(client_info.buf, "PORT")) command_port(&client_info);
-			else if (compare_command(client_info.buf, "PASV")) command_pasv(&client_info);
-			else if (compare_command(client_info.buf, "LIST")) command_list(&client_info);
-			else if (compare_command(client_info.buf, "CWD")) command_cwd(&client_info);
-			else if (compare_command(client_info.buf, "RETR")) command_retr(&client_info);
-			else if (compare_command(client_info.buf, "NOOP")) command_noop(&client_info);
-			else if (compare_command(client_info.buf, "SYST")) command_syst(&client_info);
-			else if (compare_command(client_info.buf, "TYPE")) command_type(&client_info);
-			else if (compare_command(client_info.buf, "QUIT"))
+			// all buffered commands are processed, send their replies at once before waiting for more
+			flush_replies(client_info);
+			if (client_info->closing) break;
+
+			if (! session_set_idle(client_info))
 			{
-				get_line(client_info.fd, line, client_info.buf, &client_info.buffer_pos);
-				send_code(client_info.fd, 221);
-				close(client_info.fd);
-				client_info.fd = 0;
-				return NULL;
+				send_code(client_info, 421);
+				break;
 			}
-			else
+
+			int result = client_read(client_info);
+			if (result <= 0)
 			{
-				get_line(client_info.fd, line, client_info.buf, &client_info.buffer_pos);
-				send_code(client_info.fd, 500);
+				// draining shuts down idle sessions for reading, they are told the same as the others
+				if (server_draining()) send_code(client_info, 421);
+				break;
 			}
+
+			session_set_busy(client_info);
+			continue;
 		}
+
+		char * line = extract_line(client_info, len);
+		dispatch_command(client_info, line);
+		free(line);
+	}
+
+	flush_replies(client_info);
+
+	unregister_session(client_info);
+
+	if (client_info->fd != 0)
+	{
+		close(client_info->fd);
+		client_info->fd = 0;
 	}
 
-	if (client_info.fd != 0)
+	release_dir(client_info->dir);
+	if (client_info->buf != client_info->inline_buf)
 	{
-		close(client_info.fd);
-		client_info.fd = 0;
+		free(client_info->buf);
+		account_session_bytes(-BUFFER_SIZE);
 	}
 
+	free(client_info);
+	account_session_bytes(-(long)sizeof(CLIENT_INFO));
+
 	return NULL;
 }
 
+// wakes up the main loop from a signal handler
+void wake_main_loop()
+{
+	int saved_errno = errno;
+	if (write(signal_pipe[1], "", 1) == -1)
+	{
+		// the pipe is full, the main loop is woken up already
+	}
+	errno = saved_errno;
+}
+
+// signal handler for SIGHUP, requests a graceful restart
+void handle_restart_signal(int sig)
+{
+	restart_requested = 1;
+	wake_main_loop();
+}
+
+// signal handler for SIGUSR1, requests statistics
+void handle_stats_signal(int sig)
+{
+	stats_requested = 1;
+	wake_main_loop();
+}
+
+// returns the resident set size of the process in bytes, or -1 if it cannot be determined
+long resident_bytes()
+{
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (! f) return -1;
+
+	long size, resident;
+	int result = fscanf(f, "%ld %ld", &size, &resident);
+	fclose(f);
+	if (result != 2) return -1;
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// prints out memory used by client sessions
+void print_memory_stats(long baseline_rss)
+{
+	pthread_mutex_lock(&sessions_mutex);
+	int count = session_count;
+	long bytes = session_bytes;
+	pthread_mutex_unlock(&sessions_mutex);
+
+	pthread_mutex_lock(&dirs_mutex);
+	int dcount = dir_count;
+	long dbytes = dir_bytes;
+	pthread_mutex_unlock(&dirs_mutex);
+
+	printf("sessions: %d\n", count);
+	printf("session state: %ld bytes (%ld per session)\n", bytes, count ? bytes / count : 0);
+	printf("shared directories: %d (%ld bytes)\n", dcount, dbytes);
+	printf("thread stack: %d bytes reserved per session\n", SESSION_STACK_SIZE);
+
+	long rss = resident_bytes();
+	if ((rss != -1) && (baseline_rss != -1))
+	{
+		long delta = rss - baseline_rss;
+		printf("resident: %ld bytes, %ld since start (%ld per session)\n", rss, delta, count ? delta / count : 0);
+	}
+
+	fflush(stdout);
+}
+
+// executes a new instance of the server which inherits the listening socket,
+// returns 0 once the new instance is ready to accept connections
+int spawn_successor(int server)
+{
+	int ready[2];
+	if (pipe(ready) == -1)
+	{
+		perror("pipe");
+		return -1;
+	}
+
+	// client threads read the environment (localtime() looks up TZ), so it is not modified here,
+	// the new instance gets a copy of it extended with the two descriptors
+	char listen_env[64], ready_env[64];
+	snprintf(listen_env, sizeof(listen_env), "%s=%d", LISTEN_FD_ENV, server);
+	snprintf(ready_env, sizeof(ready_env), "%s=%d", READY_FD_ENV, ready[1]);
+
+	int count = 0;
+	while (environ[count]) count++;
+
+	char ** envp = malloc((count + 3) * sizeof(char *));
+	if (! envp) epicfail("malloc");
+
+	int i, n = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (strncmp(environ[i], LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) == 0) continue;
+		if (strncmp(environ[i], READY_FD_ENV "=", strlen(READY_FD_ENV) + 1) == 0) continue;
+		envp[n++] = environ[i];
+	}
+	envp[n++] = listen_env;
+	envp[n++] = ready_env;
+	envp[n] = NULL;
+
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	fflush(stdout);
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// only the listening socket and the readiness pipe are passed on
+		int fd;
+		for (fd = 3; fd < max_fd; fd++)
+			if ((fd != server) && (fd != ready[1])) close(fd);
+
+		// the child has a single thread, switching its environment is a plain pointer store
+		environ = envp;
+		execvp(server_argv[0], server_argv);
+		_exit(127);
+	}
+
+	free(envp);
+	close(ready[1]);
+
+	if (pid == -1)
+	{
+		perror("fork");
+		close(ready[0]);
+		return -1;
+	}
+
+	// the new instance writes one byte when ready, EOF means it has failed
+	char c;
+	int bytes_read;
+	do bytes_read = read(ready[0], &c, 1); while ((bytes_read == -1) && (errno == EINTR));
+	close(ready[0]);
+
+	if (bytes_read != 1)
+	{
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+// tells the previous instance (if any) that this instance accepts connections
+void signal_ready()
+{
+	char * env = getenv(READY_FD_ENV);
+	if (! env) return;
+
+	int fd = atoi(env);
+	unsetenv(READY_FD_ENV);
+	if (write(fd, "1", 1) != 1) perror("write");
+	close(fd);
+}
+
+// waits for running sessions to finish, idle sessions are closed right away,
+// sessions still running after DRAIN_TIMEOUT (e.g. waiting for a data connection that never comes) are abandoned
+void drain_sessions()
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += DRAIN_TIMEOUT;
+
+	pthread_mutex_lock(&sessions_mutex);
+	draining = 1;
+
+	CLIENT_INFO * s;
+	for (s = sessions; s; s = s->next)
+	{
+		if (! s->busy) shutdown(s->fd, SHUT_RD);
+	}
+
+	while (session_count > 0)
+	{
+		if (pthread_cond_timedwait(&sessions_cond, &sessions_mutex, &deadline) == ETIMEDOUT)
+		{
+			printf("%d session(s) still running after %d seconds, exiting\n", session_count, DRAIN_TIMEOUT);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&sessions_mutex);
+}
+
+// prints out the latest TCP_INFO sample of every running transfer
+void print_transfer_stats()
+{
+	pthread_mutex_lock(&sessions_mutex);
+
+	CLIENT_INFO * s;
+	for (s = sessions; s; s = s->next)
+	{
+		if (! s->transferring) continue;
+
+		printf("transfer on fd %d: rtt %u us, cwnd %u x %u bytes, rate %llu bytes/s, chunk %d, sndbuf %d\n",
+			data_connection_fd(s), s->tcp_rtt, s->tcp_cwnd, s->tcp_mss, s->tcp_rate, s->data_chunk, s->data_sndbuf);
+	}
+
+	pthread_mutex_unlock(&sessions_mutex);
+	fflush(stdout);
+}
+
 // prints out usage
 int help()
 {
@@ -703,6 +1824,10 @@ int help()
 	printf("  -h              prints help (this info)\n");
 	printf("  -s ip           listens on the specified IP address (default 0.0.0.0)\n");
 	printf("  -d dir          uses the specified directory as the base directory\n");
+	printf("  -b bytes        send buffer size of data connections (default kernel autotuning)\n");
+	printf("  -c algorithm    TCP congestion control algorithm of data connections\n");
+	printf("send SIGHUP to restart gracefully (the listening socket is handed over to the new instance)\n");
+	printf("send SIGUSR1 to print memory used by client sessions and running transfers\n");
 
 	return 0;
 }
@@ -713,9 +1838,10 @@ int main(int argc, char * argv[])
 	char * source_addr = "0.0.0.0";
 	int source_port = 21;
 	strcpy(basedir, "/");
+	server_argv = argv;
 
 	int c;
-	while ((c = getopt (argc, argv, ":s:p:d:h")) != -1)
+	while ((c = getopt (argc, argv, ":s:p:d:b:c:h")) != -1)
 	{
 		if (c == 's')
 		{
@@ -729,6 +1855,14 @@ int main(int argc, char * argv[])
 		{
 			strcpy(basedir, optarg);
 		}
+		else if (c == 'b')
+		{
+			data_sndbuf = atoi(optarg);
+		}
+		else if (c == 'c')
+		{
+			data_congestion = optarg;
+		}
 		else if (c == ':')
 		{
 			printf("-%c requires an argument\n", optopt);
@@ -761,14 +1895,105 @@ int main(int argc, char * argv[])
 
 	if (strcmp(basedir, "/") == 0) strcpy(basedir, "");
 
-	printf("listening on %s:%d\n", source_addr, source_port);
-	int server = create_tcp_server_socket(source_addr, source_port);
+	int server;
+	char * inherited_fd = getenv(LISTEN_FD_ENV);
+	if (inherited_fd)
+	{
+		server = atoi(inherited_fd);
+		unsetenv(LISTEN_FD_ENV);
+		printf("listening on inherited socket\n");
+	}
+	else
+	{
+		printf("listening on %s:%d\n", source_addr, source_port);
+		server = create_tcp_server_socket(source_addr, source_port, SOMAXCONN);
+	}
+
+	// the signal handlers wake up the main loop through the self-pipe, so a signal
+	// arriving right before poll() is not left waiting for the next client
+	if (pipe(signal_pipe) == -1) epicfail("pipe");
+	fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_restart_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = handle_stats_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// client threads never handle SIGHUP and SIGUSR1, the main thread does
+	sigset_t main_set, old_set;
+	sigemptyset(&main_set);
+	sigaddset(&main_set, SIGHUP);
+	sigaddset(&main_set, SIGUSR1);
+
+	// client threads are never joined and run with a small stack
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE)) epicfail("pthread_attr_setstacksize");
+
+	long baseline_rss = resident_bytes();
+
+	signal_ready();
 
 	while (1)
 	{
+		if (stats_requested)
+		{
+			stats_requested = 0;
+			print_memory_stats(baseline_rss);
+			print_transfer_stats();
+		}
+
+		if (restart_requested)
+		{
+			restart_requested = 0;
+			printf("restarting...\n");
+
+			if (spawn_successor(server) == 0)
+			{
+				close(server);
+				printf("new instance is ready, waiting for running sessions to finish\n");
+				fflush(stdout);
+				drain_sessions();
+				return 0;
+			}
+
+			printf("restart failed, continuing\n");
+		}
+
+		struct pollfd fds[2];
+		fds[0].fd = server;
+		fds[0].events = POLLIN;
+		fds[1].fd = signal_pipe[0];
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR) continue;
+			epicfail("poll");
+		}
+
+		if (fds[1].revents)
+		{
+			char drain[16];
+			while (read(signal_pipe[0], drain, sizeof(drain)) > 0);
+		}
+
+		if (! (fds[0].revents & POLLIN)) continue;
+
 		int client = accept_connection(server);
+		if (client == -1) continue;
+
+		CLIENT_INFO * client_info = create_session(client);
+
 		pthread_t thread_id;
-		int result = pthread_create(&thread_id, NULL, thread_proc, (void *)client);
+		pthread_sigmask(SIG_BLOCK, &main_set, &old_set);
+		int result = pthread_create(&thread_id, &attr, thread_proc, client_info);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
 		if (result) epicfail("pthread_create");
 	}
 }